@@ -0,0 +1,270 @@
+#include "rpc.h"
+#include "rpc_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A request loaded from a trace */
+typedef struct {
+    uint64_t timestamp_ns;
+    int operation;
+    char *function_name;
+    rpc_data data;
+} trace_entry;
+
+/* Result of replaying one request */
+typedef struct {
+    const trace_entry *entry;
+    const struct sockaddr_in6 *server_addr;
+    uint64_t latency_ns;
+    int status;
+} replay_result;
+
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_done = PTHREAD_COND_INITIALIZER;
+static int pending = 0;
+
+/* Reads all records of a trace into memory so parsing doesn't disturb the replay timing */
+static trace_entry *load_trace(char *path, size_t *count) {
+    FILE *trace_file = fopen(path, "rb");
+    if (trace_file == NULL) {
+        perror("fopen");
+        return NULL;
+    }
+
+    // Check the trace header
+    char magic[RPC_TRACE_MAGIC_LEN];
+    uint32_t version_net;
+    if (fread(magic, 1, sizeof(magic), trace_file) != sizeof(magic) ||
+        memcmp(magic, RPC_TRACE_MAGIC, RPC_TRACE_MAGIC_LEN) != 0 ||
+        fread(&version_net, 1, sizeof(version_net), trace_file) != sizeof(version_net) ||
+        ntohl(version_net) != RPC_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a request trace\n", path);
+        fclose(trace_file);
+        return NULL;
+    }
+
+    size_t capacity = 64;
+    size_t n = 0;
+    trace_entry *entries = malloc(capacity * sizeof(trace_entry));
+    unsigned char header[RPC_TRACE_RECORD_HEADER_LEN];
+    while (entries != NULL && fread(header, 1, sizeof(header), trace_file) == sizeof(header)) {
+        if (n == capacity) {
+            capacity *= 2;
+            trace_entry *grown = realloc(entries, capacity * sizeof(trace_entry));
+            if (grown == NULL) {
+                break;
+            }
+            entries = grown;
+        }
+
+        // Decode the record header
+        uint64_t timestamp_net, data1_net;
+        uint32_t operation_net, name_len_net, data_len_net;
+        memcpy(&timestamp_net, header, 8);
+        memcpy(&operation_net, header + 8, 4);
+        memcpy(&name_len_net, header + 12, 4);
+        memcpy(&data_len_net, header + 16, 4);
+        memcpy(&data1_net, header + 20, 8);
+
+        trace_entry *entry = &entries[n];
+        size_t name_len = ntohl(name_len_net);
+        entry->timestamp_ns = ntohll(timestamp_net);
+        entry->operation = (int)ntohl(operation_net);
+        entry->data.data1 = (int)ntohll(data1_net);
+        entry->data.data2_len = ntohl(data_len_net);
+        entry->function_name = malloc(name_len + 1);
+        entry->data.data2 = entry->data.data2_len > 0 ? malloc(entry->data.data2_len) : NULL;
+        if (entry->function_name == NULL || (entry->data.data2_len > 0 && entry->data.data2 == NULL) ||
+            fread(entry->function_name, 1, name_len, trace_file) != name_len ||
+            fread(entry->data.data2, 1, entry->data.data2_len, trace_file) != entry->data.data2_len) {
+            // Stop at a truncated record, e.g. if the server was killed mid-write
+            free(entry->function_name);
+            free(entry->data.data2);
+            break;
+        }
+        entry->function_name[name_len] = '\0';
+        n++;
+    }
+
+    fclose(trace_file);
+    *count = n;
+    return entries;
+}
+
+/* Sends one traced request and waits for the server to answer and close the connection */
+static void *replay_request(void *arg) {
+    replay_result *result = arg;
+    const trace_entry *entry = result->entry;
+    uint64_t start = monotonic_ns();
+
+    int sock = connect_to_address(result->server_addr);
+    if (sock >= 0) {
+        rpc_send_message(sock, entry->operation, entry->function_name, (rpc_data *)&entry->data);
+
+        // Read the status, then drain the rest of the response
+        size_t name_len, data_len;
+        char *function_name;
+        if (read_message(sock, &result->status, &name_len, &data_len, &function_name) == 0) {
+            free(function_name);
+            char discard[4096];
+            while (read(sock, discard, sizeof(discard)) > 0) {
+            }
+        }
+        close(sock);
+    }
+    result->latency_ns = monotonic_ns() - start;
+
+    pthread_mutex_lock(&pending_lock);
+    pending--;
+    pthread_cond_signal(&pending_done);
+    pthread_mutex_unlock(&pending_lock);
+    return NULL;
+}
+
+/* Compares latencies for qsort */
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Prints the latency distribution and status counts of a replay */
+static void report(const replay_result *results, size_t count, uint64_t elapsed_ns) {
+    uint64_t *latencies = malloc(count * sizeof(uint64_t));
+    if (latencies == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    int succeeded = 0, failed = 0, overloaded = 0, unavailable = 0;
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        latencies[i] = results[i].latency_ns;
+        total += results[i].latency_ns;
+        switch (results[i].status) {
+            case RPC_SUCCESS:
+                succeeded++;
+                break;
+            case RPC_OVERLOADED:
+                overloaded++;
+                break;
+            case RPC_UNAVAILABLE:
+                unavailable++;
+                break;
+            default:
+                failed++;
+                break;
+        }
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_latency);
+
+    printf("requests: %zu in %.3f s\n", count, elapsed_ns / 1e9);
+    printf("status: %d succeeded, %d failed, %d overloaded, %d unavailable\n", succeeded, failed,
+           overloaded, unavailable);
+    printf("latency ms: min %.3f mean %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+           latencies[0] / 1e6, total / 1e6 / count, latencies[count / 2] / 1e6,
+           latencies[(count * 90) / 100] / 1e6, latencies[(count * 99) / 100] / 1e6,
+           latencies[count - 1] / 1e6);
+    free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+    char *ip_address = "::1"; // default IP address
+    int port = 3000;          // default port
+    double speed = 1.0;       // 1 replays at the original pace, 0 as fast as possible
+    int opt;
+
+    // Parse command line options
+    while ((opt = getopt(argc, argv, "i:p:s:")) != -1) {
+        switch (opt) {
+            case 'i':
+                ip_address = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i addr] [-p port] [-s speed] trace\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1 || speed < 0) {
+        fprintf(stderr, "Usage: %s [-i addr] [-p port] [-s speed] trace\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Reuse the client's address parsing
+    rpc_client *cl = rpc_init_client(ip_address, port);
+    if (cl == NULL) {
+        fprintf(stderr, "Invalid address %s\n", ip_address);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count;
+    trace_entry *entries = load_trace(argv[optind], &count);
+    if (entries == NULL || count == 0) {
+        fprintf(stderr, "No requests to replay\n");
+        exit(EXIT_FAILURE);
+    }
+    replay_result *results = calloc(count, sizeof(replay_result));
+    if (results == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Issue every request at its original offset scaled by speed, each on its own thread
+    uint64_t start = monotonic_ns();
+    for (size_t i = 0; i < count; i++) {
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)(entries[i].timestamp_ns / speed);
+            uint64_t now = monotonic_ns();
+            if (due > now) {
+                struct timespec ts = {(due - now) / 1000000000ULL, (due - now) % 1000000000ULL};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        results[i].entry = &entries[i];
+        results[i].server_addr = &cl->server_addr;
+        results[i].status = RPC_UNAVAILABLE;
+        pthread_mutex_lock(&pending_lock);
+        pending++;
+        pthread_mutex_unlock(&pending_lock);
+
+        pthread_t thread;
+        int created = pthread_create(&thread, NULL, replay_request, &results[i]);
+        if (created != 0) {
+            // pthread_create returns the error instead of setting errno
+            fprintf(stderr, "pthread_create: %s\n", strerror(created));
+            replay_request(&results[i]);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // Wait for the outstanding requests
+    pthread_mutex_lock(&pending_lock);
+    while (pending > 0) {
+        pthread_cond_wait(&pending_done, &pending_lock);
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    report(results, count, monotonic_ns() - start);
+
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].function_name);
+        free(entries[i].data.data2);
+    }
+    free(entries);
+    free(results);
+    rpc_close_client(cl);
+    return 0;
+}
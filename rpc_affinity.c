@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include "rpc.h"
+#include "rpc_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+
+/* CPU placement of the server's threads */
+struct cpu_affinity {
+    int pin_io;
+    int io_pinned; // the accept thread is running on io_cpus
+    cpu_set_t io_cpus;
+    cpu_set_t caller_cpus; // CPUs of the thread that called rpc_serve_all before pinning
+    cpu_set_t worker_cpus;
+    int n_nodes;
+    cpu_set_t node_workers[RPC_MAX_NUMA_NODES]; // worker CPUs on each NUMA node
+    int cpu_node[CPU_SETSIZE];
+};
+
+/* Helper function to parse a sysfs CPU list such as "0-3,8-11" into a set */
+static void parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0) {
+                CPU_SET(cpu, set);
+            }
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Helper function to read the NUMA topology, every CPU is on node 0 if sysfs has none */
+static void load_numa_topology(struct cpu_affinity *affinity) {
+    memset(affinity->cpu_node, 0, sizeof(affinity->cpu_node));
+    affinity->n_nodes = 1;
+
+    char path[64];
+    char list[1024];
+    for (int node = 0; node < RPC_MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        cpu_set_t node_cpus;
+        if (fgets(list, sizeof(list), file) != NULL) {
+            parse_cpu_list(list, &node_cpus);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &node_cpus)) {
+                    affinity->cpu_node[cpu] = node;
+                }
+            }
+            if (node + 1 > affinity->n_nodes) {
+                affinity->n_nodes = node + 1;
+            }
+        }
+        fclose(file);
+    }
+}
+
+/* Function to configure thread placement */
+int rpc_set_cpu_affinity(rpc_server *srv, const int *io_cpus, int n_io, const int *worker_cpus,
+                         int n_workers) {
+    // Return failure if any of the arguments is invalid
+    if (srv == NULL || n_io < 0 || n_workers < 0 || (io_cpus == NULL && n_io > 0) ||
+        (worker_cpus == NULL && n_workers > 0)) {
+        return -1;
+    }
+
+    struct cpu_affinity *affinity = malloc(sizeof(struct cpu_affinity));
+    if (affinity == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    // Only CPUs the process may run on are usable, others make pthread_create fail
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+        perror("sched_getaffinity");
+        free(affinity);
+        return -1;
+    }
+
+    // Collect the I/O CPUs
+    affinity->pin_io = n_io > 0;
+    affinity->io_pinned = 0;
+    affinity->caller_cpus = allowed;
+    CPU_ZERO(&affinity->io_cpus);
+    for (int i = 0; i < n_io; i++) {
+        if (io_cpus[i] < 0 || io_cpus[i] >= CPU_SETSIZE) {
+            free(affinity);
+            return -1;
+        }
+        CPU_SET(io_cpus[i], &affinity->io_cpus);
+    }
+    CPU_AND(&affinity->io_cpus, &affinity->io_cpus, &allowed);
+
+    // Collect the worker CPUs, defaulting to every CPU the process may run on
+    CPU_ZERO(&affinity->worker_cpus);
+    if (n_workers == 0) {
+        affinity->worker_cpus = allowed;
+    }
+    for (int i = 0; i < n_workers; i++) {
+        if (worker_cpus[i] < 0 || worker_cpus[i] >= CPU_SETSIZE) {
+            free(affinity);
+            return -1;
+        }
+        CPU_SET(worker_cpus[i], &affinity->worker_cpus);
+    }
+    CPU_AND(&affinity->worker_cpus, &affinity->worker_cpus, &allowed);
+
+    // Return failure if none of the requested CPUs are usable
+    if ((affinity->pin_io && CPU_COUNT(&affinity->io_cpus) == 0) ||
+        CPU_COUNT(&affinity->worker_cpus) == 0) {
+        free(affinity);
+        return -1;
+    }
+
+    // Split the worker CPUs by NUMA node
+    load_numa_topology(affinity);
+    for (int node = 0; node < RPC_MAX_NUMA_NODES; node++) {
+        CPU_ZERO(&affinity->node_workers[node]);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &affinity->worker_cpus)) {
+            CPU_SET(cpu, &affinity->node_workers[affinity->cpu_node[cpu]]);
+        }
+    }
+
+    free(srv->affinity);
+    srv->affinity = affinity;
+    return 1;
+}
+
+/* Helper function to pin the calling accept thread to the I/O CPUs, saving its CPUs first */
+void pin_io_thread(rpc_server *srv) {
+    struct cpu_affinity *affinity = srv->affinity;
+    if (affinity == NULL) {
+        return;
+    }
+
+    // Remember the caller's CPUs, they are restored when serving stops and used by workers
+    // that can't run on the worker CPUs
+    pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity->caller_cpus);
+    if (!affinity->pin_io) {
+        return;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity->io_cpus) != 0) {
+        fprintf(stderr, "Failed to pin I/O thread\n");
+        return;
+    }
+    affinity->io_pinned = 1;
+}
+
+/* Helper function to move the accept thread back to the CPUs it had before pin_io_thread */
+void restore_io_thread(rpc_server *srv) {
+    struct cpu_affinity *affinity = srv->affinity;
+    if (affinity == NULL || !affinity->io_pinned) {
+        return;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &affinity->caller_cpus) != 0) {
+        fprintf(stderr, "Failed to restore I/O thread CPUs\n");
+        return;
+    }
+    affinity->io_pinned = 0;
+}
+
+/* Helper function to place a new worker thread on the worker CPUs, or on the caller's
+ * CPUs as a fallback. The mask is always explicit so workers never inherit the I/O CPUs. */
+int set_worker_affinity(rpc_server *srv, pthread_attr_t *attr, int fallback) {
+    struct cpu_affinity *affinity = srv->affinity;
+    if (affinity == NULL) {
+        return 0;
+    }
+    const cpu_set_t *cpus = fallback ? &affinity->caller_cpus : &affinity->worker_cpus;
+    return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), cpus) == 0;
+}
+
+/* Helper function to move a worker to the NUMA node that receives a connection's packets */
+void steer_worker(rpc_server *srv, int client_sock, int *node) {
+    struct cpu_affinity *affinity = srv->affinity;
+    if (affinity == NULL || affinity->n_nodes < 2) {
+        return;
+    }
+
+    // The CPU that handled the connection's packets decides the node, so the handler runs
+    // next to the socket data already in that node's caches. Only move when the node changes.
+#ifdef SO_INCOMING_CPU
+    int incoming_cpu = -1;
+    socklen_t len = sizeof(incoming_cpu);
+    if (getsockopt(client_sock, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &len) != 0 ||
+        incoming_cpu < 0 || incoming_cpu >= CPU_SETSIZE) {
+        return;
+    }
+    int incoming_node = affinity->cpu_node[incoming_cpu];
+    if (incoming_node == *node || CPU_COUNT(&affinity->node_workers[incoming_node]) == 0) {
+        return;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                               &affinity->node_workers[incoming_node]) == 0) {
+        *node = incoming_node;
+    }
+#endif
+}
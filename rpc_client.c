@@ -8,6 +8,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <time.h>
 
 
 /* Function to initialize client */
@@ -32,6 +33,12 @@ rpc_client *rpc_init_client(char *addr, int port) {
     // Store the server details
     client->server_addr = server_addr;
     client->is_connected = 1;
+    pthread_mutex_init(&client->lock, NULL);
+    client->last_status = RPC_SUCCESS;
+    client->has_hedge_addr = 0;
+    client->latency_count = 0;
+    client->latency_next = 0;
+    client->rand_seed = (unsigned int)(monotonic_ns() ^ (uint64_t)getpid());
     return client;
 }
 
@@ -45,6 +52,7 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
     // Create a new socket
     int client_sock = create_and_connect_socket(cl);
     if (client_sock < 0) {
+        set_last_status(cl, RPC_UNAVAILABLE);
         return NULL;
     }
 
@@ -57,6 +65,16 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
     size_t name_len, data_len;
     char *function_name;
     if (read_message(client_sock, &operation, &name_len, &data_len, &function_name) < 0) {
+        set_last_status(cl, RPC_UNAVAILABLE);
+        close(client_sock);
+        return NULL;
+    }
+
+    // Return NULL if the function wasn't found or the server is overloaded
+    set_last_status(cl, operation);
+    if (operation != RPC_SUCCESS) {
+        free(function_name);
+        close(client_sock);
         return NULL;
     }
 
@@ -65,6 +83,7 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
     if (handle == NULL) {
         perror("malloc");
         free(function_name); // free memory if handle allocation fails
+        close(client_sock);
         return NULL;
     }
     handle->function_name = function_name;
@@ -79,12 +98,24 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
 
     // Free the discard_buffer after use
     free(discard_buffer);
+    close(client_sock);
 
     return handle;
 }
 
 /* Function to create a new connection and send a call request to the server */
 rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    return rpc_call_with_status(cl, h, payload, NULL);
+}
+
+/* Function to send a call request and report its status */
+rpc_data *rpc_call_with_status(rpc_client *cl, rpc_handle *h, rpc_data *payload, int *status) {
+    int call_status;
+    if (status == NULL) {
+        status = &call_status;
+    }
+    *status = RPC_ERROR;
+
     // Return NULL if any of the arguments is NULL
     if (cl == NULL || h == NULL || payload == NULL) {
         return NULL;
@@ -103,50 +134,110 @@ rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
         return NULL;
     }
 
-    // Create a new socket
-    int client_sock = create_and_connect_socket(cl);
-    if (client_sock < 0) {
-        return NULL;
+    return send_and_receive_call(cl, &cl->server_addr, h, payload, status);
+}
+
+/* Function to get the status of the client's most recent call */
+int rpc_last_status(rpc_client *cl) {
+    if (cl == NULL) {
+        return RPC_ERROR;
     }
+    pthread_mutex_lock(&cl->lock);
+    int status = cl->last_status;
+    pthread_mutex_unlock(&cl->lock);
+    return status;
+}
 
-    // Send rpc_call message
-    rpc_send_message(client_sock, RPC_CALL, h->function_name, payload);
+/* Function to set the secondary endpoint used for hedging and retries */
+int rpc_add_hedge_endpoint(rpc_client *cl, char *addr, int port) {
+    // Return failure if any of the arguments is NULL
+    if (cl == NULL || addr == NULL) {
+        return -1;
+    }
 
-    // Receive response
-    int operation;
-    size_t name_len, data_len;
-    char *function_name;
-    if (read_message(client_sock, &operation, &name_len, &data_len, &function_name) < 0) {
+    struct sockaddr_in6 hedge_addr;
+    memset(&hedge_addr, 0, sizeof(hedge_addr));
+    hedge_addr.sin6_family = AF_INET6;
+    hedge_addr.sin6_port = htons(port);
+    if (inet_pton(AF_INET6, addr, &hedge_addr.sin6_addr) <= 0) {
+        return -1;
+    }
+
+    cl->hedge_addr = hedge_addr;
+    cl->has_hedge_addr = 1;
+    return 1;
+}
+
+/* Function to call an idempotent function with retries and hedging */
+rpc_data *rpc_call_with_options(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                                const rpc_call_options *opts, int *status) {
+    // Plain call if no options are given
+    if (opts == NULL) {
+        return rpc_call_with_status(cl, h, payload, status);
+    }
+
+    int call_status;
+    if (status == NULL) {
+        status = &call_status;
+    }
+    *status = RPC_ERROR;
+
+    // Return NULL if any of the arguments is NULL
+    if (cl == NULL || h == NULL || payload == NULL) {
         return NULL;
     }
 
-    // Allocate new rpc_data structure
-    rpc_data *output_data = malloc(sizeof(rpc_data));
-    if (output_data == NULL) {
-        perror("malloc");
+    // Check if data2_len is too large to be encoded in the packet format
+    if (payload->data2_len > 100000) {
+        fprintf(stderr, "Overlength error\n");
+        return NULL;
+    }
+
+    // Return NULL if data2_len doesn't match the actual size of data2
+    if ((payload->data2 == NULL && payload->data2_len != 0) ||
+        (payload->data2 != NULL && payload->data2_len == 0)) {
         return NULL;
     }
-    output_data->data2_len = data_len;
 
-    // Free the function_name as it's not used after this point
-    free(function_name);
+    for (int attempt = 0;; attempt++) {
+        // Retries alternate to the secondary endpoint if one is set
+        const struct sockaddr_in6 *primary = &cl->server_addr;
+        const struct sockaddr_in6 *secondary = cl->has_hedge_addr ? &cl->hedge_addr : &cl->server_addr;
+        if (attempt % 2 == 1) {
+            const struct sockaddr_in6 *tmp = primary;
+            primary = secondary;
+            secondary = tmp;
+        }
 
-    // Read output data
-    uint64_t data1_net;
-    read(client_sock, &data1_net, sizeof(data1_net));
-    output_data->data1 = ntohll(data1_net);
-    if (data_len > 0) {
-        output_data->data2 = malloc(data_len);
-        if (output_data->data2 == NULL) {
-            perror("malloc");
-            free(output_data);
+        // Decide on this call's own status, last_status may belong to another thread's call
+        rpc_data *output_data = opts->hedge
+                                    ? hedged_call(cl, primary, secondary, h, payload, opts, status)
+                                    : send_and_receive_call(cl, primary, h, payload, status);
+        if (output_data != NULL) {
+            return output_data;
+        }
+
+        // Only connection failures and overload are worth retrying
+        if (attempt >= opts->max_retries || (*status != RPC_UNAVAILABLE && *status != RPC_OVERLOADED)) {
             return NULL;
         }
-        read(client_sock, output_data->data2, data_len);
-    } else {
-        output_data->data2 = NULL;
+
+        // Sleep for a random time up to the exponential backoff (full jitter)
+        int backoff_ms = opts->backoff_base_ms;
+        for (int i = 0; i < attempt && backoff_ms < opts->backoff_max_ms; i++) {
+            backoff_ms *= 2;
+        }
+        if (backoff_ms > opts->backoff_max_ms) {
+            backoff_ms = opts->backoff_max_ms;
+        }
+        if (backoff_ms > 0) {
+            pthread_mutex_lock(&cl->lock);
+            int sleep_ms = rand_r(&cl->rand_seed) % (backoff_ms + 1);
+            pthread_mutex_unlock(&cl->lock);
+            struct timespec ts = {sleep_ms / 1000, (sleep_ms % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+        }
     }
-    return output_data;
 }
 
 /* Function to close client */
@@ -155,5 +246,6 @@ void rpc_close_client(rpc_client *cl) {
         return;
     }
     // Free the client struct
+    pthread_mutex_destroy(&cl->lock);
     free(cl);
 }
\ No newline at end of file
@@ -4,40 +4,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
 
 
 /* Helper function to convert 8-byte integer to network byte order */
 uint64_t htonll(uint64_t value) {
-    // Check the endianness of the system
-    const int num = 1;
-    if(*(char *)&num == 1) {
-        // If the system is little endian
-        const uint32_t high_part = htonl((uint32_t)(value >> 32));
-        const uint32_t low_part = htonl((uint32_t)(value & 0xFFFFFFFFLL));
-
-        return (((uint64_t)low_part) << 32) | high_part;
-    } else {
-        // If the system is big endian
-        return value;
-    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
 }
 
 /* Helper function to convert network byte order to 8-byte integer */
 uint64_t ntohll(uint64_t value) {
-    // Check the endianness of the system
-    const int num = 1;
-    if(*(char *)&num == 1) {
-        // If the system is little endian
-        const uint32_t high_part = ntohl((uint32_t)(value >> 32));
-        const uint32_t low_part = ntohl((uint32_t)(value & 0xFFFFFFFFLL));
-
-        return (((uint64_t)low_part) << 32) | high_part;
-    } else {
-        // If the system is big endian
-        return value;
-    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+/* Helper function to read the monotonic clock in nanoseconds */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
 /* Helper function to send message using designed protocol */
@@ -47,26 +43,26 @@ int rpc_send_message(int sock, int operation, char *name, rpc_data *data) {
     uint32_t data_len_net = data ? htonl(data->data2_len) : 0;
     uint64_t data1_net = data ? htonll((uint64_t)data->data1) : 0;
 
-    // Send header
-    write(sock, &operation, sizeof(operation));
-    write(sock, &name_len_net, sizeof(name_len_net));
-    write(sock, &data_len_net, sizeof(data_len_net));
+    // Send header, MSG_NOSIGNAL so a peer that cancelled the request doesn't raise SIGPIPE
+    send(sock, &operation, sizeof(operation), MSG_NOSIGNAL);
+    send(sock, &name_len_net, sizeof(name_len_net), MSG_NOSIGNAL);
+    send(sock, &data_len_net, sizeof(data_len_net), MSG_NOSIGNAL);
 
     // Send function name
-    write(sock, name, strlen(name));
+    send(sock, name, strlen(name), MSG_NOSIGNAL);
 
     if (data) {
         // Send rpc_data
-        write(sock, &data1_net, sizeof(data1_net));
-        write(sock, data->data2, data->data2_len);
+        send(sock, &data1_net, sizeof(data1_net), MSG_NOSIGNAL);
+        send(sock, data->data2, data->data2_len, MSG_NOSIGNAL);
     }
     return 0;
 }
 
 /* Helper function to receive message using designed protocol */
 int read_message(int client_sock, int *operation, size_t *name_len, size_t *data_len, char **function_name) {
-    // Read header
-    uint32_t name_len_net, data_len_net;
+    // Read header, lengths stay zero if the peer closed the connection early
+    uint32_t name_len_net = 0, data_len_net = 0;
     read(client_sock, operation, sizeof(*operation));
     read(client_sock, &name_len_net, sizeof(name_len_net));
     read(client_sock, &data_len_net, sizeof(data_len_net));
@@ -87,8 +83,8 @@ int read_message(int client_sock, int *operation, size_t *name_len, size_t *data
     return 0;
 }
 
-/* Helper function to create client socket and connect with server */
-int create_and_connect_socket(rpc_client *cl) {
+/* Helper function to create client socket and connect to the given address */
+int connect_to_address(const struct sockaddr_in6 *addr) {
     int client_sock = socket(AF_INET6, SOCK_STREAM, 0);
     if (client_sock < 0) {
         perror("Socket creation failed");
@@ -96,13 +92,211 @@ int create_and_connect_socket(rpc_client *cl) {
     }
 
     // Connect to the server
-    if (connect(client_sock, (struct sockaddr *)&cl->server_addr, sizeof(cl->server_addr)) < 0) {
-        free(cl);
+    if (connect(client_sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        close(client_sock);
         return -1;
     }
     return client_sock;
 }
 
+/* Helper function to create client socket and connect with server */
+int create_and_connect_socket(rpc_client *cl) {
+    return connect_to_address(&cl->server_addr);
+}
+
+/* Helper function to record the status of the last response, safe for shared clients */
+void set_last_status(rpc_client *cl, int status) {
+    pthread_mutex_lock(&cl->lock);
+    cl->last_status = status;
+    pthread_mutex_unlock(&cl->lock);
+}
+
+/* Helper function to receive a call response and close the socket */
+rpc_data *receive_call_response(rpc_client *cl, int client_sock, int *status) {
+    // Every return path leaves a status, RPC_UNAVAILABLE until a response is read
+    *status = RPC_UNAVAILABLE;
+
+    // Receive response, the operation stays RPC_UNAVAILABLE if the connection dropped
+    int operation = RPC_UNAVAILABLE;
+    size_t name_len, data_len;
+    char *function_name;
+    if (read_message(client_sock, &operation, &name_len, &data_len, &function_name) < 0) {
+        set_last_status(cl, RPC_UNAVAILABLE);
+        close(client_sock);
+        return NULL;
+    }
+
+    // Free the function_name as it's not used after this point
+    free(function_name);
+
+    // Return NULL if the call failed, *status tells callers e.g. RPC_OVERLOADED apart
+    *status = operation;
+    set_last_status(cl, operation);
+    if (operation != RPC_SUCCESS) {
+        close(client_sock);
+        return NULL;
+    }
+
+    // Allocate new rpc_data structure
+    rpc_data *output_data = malloc(sizeof(rpc_data));
+    if (output_data == NULL) {
+        perror("malloc");
+        *status = RPC_ERROR;
+        set_last_status(cl, RPC_ERROR);
+        close(client_sock);
+        return NULL;
+    }
+    output_data->data2_len = data_len;
+
+    // Read output data
+    uint64_t data1_net;
+    read(client_sock, &data1_net, sizeof(data1_net));
+    output_data->data1 = ntohll(data1_net);
+    if (data_len > 0) {
+        output_data->data2 = malloc(data_len);
+        if (output_data->data2 == NULL) {
+            perror("malloc");
+            *status = RPC_ERROR;
+            set_last_status(cl, RPC_ERROR);
+            free(output_data);
+            close(client_sock);
+            return NULL;
+        }
+        read(client_sock, output_data->data2, data_len);
+    } else {
+        output_data->data2 = NULL;
+    }
+    close(client_sock);
+    return output_data;
+}
+
+/* Helper function to send a call to addr and wait for the response */
+rpc_data *send_and_receive_call(rpc_client *cl, const struct sockaddr_in6 *addr, rpc_handle *h,
+                                rpc_data *payload, int *status) {
+    uint64_t start = monotonic_ns();
+
+    // Create a new socket
+    int client_sock = connect_to_address(addr);
+    if (client_sock < 0) {
+        *status = RPC_UNAVAILABLE;
+        set_last_status(cl, RPC_UNAVAILABLE);
+        return NULL;
+    }
+
+    // Send rpc_call message and receive response
+    rpc_send_message(client_sock, RPC_CALL, h->function_name, payload);
+    rpc_data *output_data = receive_call_response(cl, client_sock, status);
+    if (output_data != NULL) {
+        record_call_latency(cl, monotonic_ns() - start);
+    }
+    return output_data;
+}
+
+/* Helper function to send a call to primary, hedged to secondary once the p95 delay has passed */
+rpc_data *hedged_call(rpc_client *cl, const struct sockaddr_in6 *primary,
+                      const struct sockaddr_in6 *secondary, rpc_handle *h, rpc_data *payload,
+                      const rpc_call_options *opts, int *status) {
+    uint64_t start = monotonic_ns();
+    *status = RPC_UNAVAILABLE;
+
+    // Send the request to the primary endpoint
+    int socks[2] = {connect_to_address(primary), -1};
+    if (socks[0] < 0) {
+        *status = RPC_UNAVAILABLE;
+        set_last_status(cl, RPC_UNAVAILABLE);
+        return NULL;
+    }
+    rpc_send_message(socks[0], RPC_CALL, h->function_name, payload);
+
+    // Wait for whichever connection answers first, hedging once the delay has passed
+    rpc_data *output_data = NULL;
+    int timeout = hedge_delay_ms(cl, opts);
+    while (output_data == NULL && (socks[0] >= 0 || socks[1] >= 0)) {
+        struct pollfd fds[2] = {{socks[0], POLLIN, 0}, {socks[1], POLLIN, 0}};
+        int ready = poll(fds, 2, timeout);
+        if (ready < 0) {
+            perror("poll");
+            break;
+        }
+        if (ready == 0) {
+            // The primary is slower than p95, send a duplicate request
+            socks[1] = connect_to_address(secondary);
+            if (socks[1] >= 0) {
+                rpc_send_message(socks[1], RPC_CALL, h->function_name, payload);
+            }
+            timeout = -1;
+            continue;
+        }
+
+        // Take the first reply, a failed reply still leaves the other connection to wait on
+        for (int i = 0; i < 2 && output_data == NULL; i++) {
+            if (socks[i] >= 0 && fds[i].revents != 0) {
+                output_data = receive_call_response(cl, socks[i], status);
+                socks[i] = -1;
+            }
+        }
+    }
+
+    // Cancel the outstanding request by closing its connection
+    for (int i = 0; i < 2; i++) {
+        if (socks[i] >= 0) {
+            close(socks[i]);
+        }
+    }
+
+    if (output_data != NULL) {
+        record_call_latency(cl, monotonic_ns() - start);
+    }
+    return output_data;
+}
+
+/* Helper function to record the latency of a successful call */
+void record_call_latency(rpc_client *cl, uint64_t latency_ns) {
+    pthread_mutex_lock(&cl->lock);
+    cl->latency_samples[cl->latency_next] = latency_ns;
+    cl->latency_next = (cl->latency_next + 1) % RPC_LATENCY_SAMPLES;
+    if (cl->latency_count < RPC_LATENCY_SAMPLES) {
+        cl->latency_count++;
+    }
+    pthread_mutex_unlock(&cl->lock);
+}
+
+/* Helper function to compare latencies for qsort */
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Helper function to compute the hedge delay from the recorded p95 latency */
+int hedge_delay_ms(rpc_client *cl, const rpc_call_options *opts) {
+    int delay_ms = opts->hedge_min_delay_ms;
+
+    // Snapshot the samples under the lock and sort the copy outside it
+    uint64_t sorted[RPC_LATENCY_SAMPLES];
+    pthread_mutex_lock(&cl->lock);
+    int count = cl->latency_count < RPC_LATENCY_SAMPLES ? cl->latency_count : RPC_LATENCY_SAMPLES;
+    memcpy(sorted, cl->latency_samples, count * sizeof(uint64_t));
+    pthread_mutex_unlock(&cl->lock);
+    if (count < RPC_MIN_HEDGE_SAMPLES) {
+        return delay_ms;
+    }
+
+    qsort(sorted, count, sizeof(uint64_t), compare_latency);
+    uint64_t p95_ns = sorted[(count * 95) / 100];
+
+    // Round up so sub-millisecond latencies don't hedge immediately
+    int p95_ms = (int)((p95_ns + 999999) / 1000000);
+    return p95_ms > delay_ms ? p95_ms : delay_ms;
+}
+
+/* Helper function to get the registered functions, safe while rpc_register runs */
+function_reg *load_registry(rpc_server *srv) {
+    // rpc_register only prepends fully initialised entries, so an acquire load of the head
+    // is enough to walk the list without a lock
+    return __atomic_load_n(&srv->registered_functions, __ATOMIC_ACQUIRE);
+}
+
 /* Helper function to find the requested function */
 function_reg *find_function(char *function_name, function_reg *function_list) {
     function_reg *current = function_list;
@@ -132,18 +326,116 @@ void handle_rpc_find(int client_sock, char *function_name, const rpc_data *data,
     rpc_send_message(client_sock, RPC_SUCCESS, function_name, NULL);
 }
 
+/* Helper function to copy a rpc_data struct */
+rpc_data *copy_rpc_data(const rpc_data *data) {
+    if (data == NULL) {
+        return NULL;
+    }
+
+    rpc_data *copy = malloc(sizeof(rpc_data));
+    if (copy == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    copy->data1 = data->data1;
+    copy->data2_len = data->data2_len;
+    copy->data2 = NULL;
+
+    // Keep a NULL data2 as NULL so the copy fails the same validation as the original
+    if (data->data2 != NULL) {
+        copy->data2 = malloc(data->data2_len > 0 ? data->data2_len : 1);
+        if (copy->data2 == NULL) {
+            perror("malloc");
+            free(copy);
+            return NULL;
+        }
+        memcpy(copy->data2, data->data2, data->data2_len);
+    }
+    return copy;
+}
+
+/* Helper function to drop a reference to a flight, returning the caller's copy of the result */
+static rpc_data *take_flight_result(flight *f) {
+    // The last connection takes the result itself instead of copying it
+    if (--f->waiters == 0) {
+        rpc_data *result = f->result;
+        pthread_cond_destroy(&f->finished);
+        free(f);
+        return result;
+    }
+    return copy_rpc_data(f->result);
+}
+
+/* Helper function to run a single-flight handler, sharing the result with identical concurrent calls */
+rpc_data *single_flight_call(rpc_server *srv, function_reg *func, rpc_handler handler, rpc_data *data) {
+    pthread_mutex_lock(&srv->flight_lock);
+
+    // Join an identical call that is already running
+    for (flight *f = srv->flights; f != NULL; f = f->next) {
+        if (f->func == func && f->handler == handler && f->request->data1 == data->data1 &&
+            f->request->data2_len == data->data2_len &&
+            (data->data2_len == 0 || memcmp(f->request->data2, data->data2, data->data2_len) == 0)) {
+            f->waiters++;
+            while (!f->done) {
+                pthread_cond_wait(&f->finished, &srv->flight_lock);
+            }
+            rpc_data *output_data = take_flight_result(f);
+            pthread_mutex_unlock(&srv->flight_lock);
+            return output_data;
+        }
+    }
+
+    // Otherwise start a new flight and run the handler outside the lock
+    flight *f = malloc(sizeof(flight));
+    if (f == NULL) {
+        perror("malloc");
+        pthread_mutex_unlock(&srv->flight_lock);
+        return handler(data);
+    }
+    f->func = func;
+    f->handler = handler;
+    f->request = data;
+    f->result = NULL;
+    f->done = 0;
+    f->waiters = 1;
+    pthread_cond_init(&f->finished, NULL);
+    f->next = srv->flights;
+    srv->flights = f;
+    pthread_mutex_unlock(&srv->flight_lock);
+
+    rpc_data *result = handler(data);
+
+    // Publish the result and unlink the flight before the request payload is freed
+    pthread_mutex_lock(&srv->flight_lock);
+    flight **link = &srv->flights;
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+    f->result = result;
+    f->done = 1;
+    pthread_cond_broadcast(&f->finished);
+    rpc_data *output_data = take_flight_result(f);
+    pthread_mutex_unlock(&srv->flight_lock);
+    return output_data;
+}
+
 /* Helper function to handle call request */
-void handle_rpc_call(int client_sock, char *function_name, rpc_data *data, function_reg *function_list) {
+void handle_rpc_call(int client_sock, char *function_name, rpc_data *data, rpc_server *srv) {
     // Check if the function is registered
-    function_reg *func = find_function(function_name, function_list);
+    function_reg *func = find_function(function_name, load_registry(srv));
     if (func == NULL) {
         // Function not found, send an error response to the client
         rpc_send_message(client_sock, RPC_ERROR, "", NULL);
         return;
     }
 
-    // Function found, call the function
-    rpc_data *output_data = func->handler(data);
+    // Function found, call the function or wait for an identical call already in progress.
+    // The handler is loaded once so a concurrent rpc_register swap applies to the next call.
+    rpc_handler handler = __atomic_load_n(&func->handler, __ATOMIC_ACQUIRE);
+    rpc_data *output_data = __atomic_load_n(&func->single_flight, __ATOMIC_RELAXED)
+                                ? single_flight_call(srv, func, handler, data)
+                                : handler(data);
 
     if (output_data == NULL) {
         rpc_send_message(client_sock, RPC_ERROR, "", NULL);
@@ -169,18 +461,224 @@ void handle_rpc_call(int client_sock, char *function_name, rpc_data *data, funct
     rpc_data_free(output_data);
 }
 
-/* Helper function to handle a new connection and fulfill request */
-void *handle_connection(void *arg) {
-    struct connection_args *args = arg;
+/* Helper function to decide whether a request that waited sojourn_ns should be shed */
+int admission_should_shed(rpc_server *srv, uint64_t sojourn_ns) {
+    // CoDel-style controller: track the minimum queueing delay over each interval. If even
+    // the minimum stayed above target, the queue is standing rather than bursting, so shed
+    // anything that waited longer than target; otherwise only shed requests that waited a
+    // whole interval.
+    uint64_t now = monotonic_ns();
+    pthread_mutex_lock(&srv->conn_lock);
+    if (now - srv->codel_interval_start > srv->codel_interval_ns) {
+        srv->codel_overloaded = srv->codel_min_delay > srv->codel_target_ns;
+        srv->codel_min_delay = sojourn_ns;
+        srv->codel_interval_start = now;
+    } else if (sojourn_ns < srv->codel_min_delay) {
+        srv->codel_min_delay = sojourn_ns;
+    }
+    uint64_t timeout = srv->codel_overloaded ? srv->codel_target_ns : srv->codel_interval_ns;
+    pthread_mutex_unlock(&srv->conn_lock);
+
+    return sojourn_ns > timeout;
+}
+
+/* Helper function to append a request that arrived at arrival_ns to the trace */
+void trace_request(rpc_server *srv, uint64_t arrival_ns, int operation, char *function_name,
+                   const rpc_data *data) {
+    pthread_mutex_lock(&srv->trace_lock);
+    if (srv->trace_file == NULL) {
+        pthread_mutex_unlock(&srv->trace_lock);
+        return;
+    }
+
+    // Encode the record header in network byte order
+    uint32_t name_len = strlen(function_name);
+    uint64_t timestamp_net = htonll(arrival_ns > srv->trace_start ? arrival_ns - srv->trace_start : 0);
+    uint32_t operation_net = htonl((uint32_t)operation);
+    uint32_t name_len_net = htonl(name_len);
+    uint32_t data_len_net = htonl(data->data2_len);
+    uint64_t data1_net = htonll((uint64_t)data->data1);
+    unsigned char header[RPC_TRACE_RECORD_HEADER_LEN];
+    memcpy(header, &timestamp_net, 8);
+    memcpy(header + 8, &operation_net, 4);
+    memcpy(header + 12, &name_len_net, 4);
+    memcpy(header + 16, &data_len_net, 4);
+    memcpy(header + 20, &data1_net, 8);
+
+    fwrite(header, 1, sizeof(header), srv->trace_file);
+    fwrite(function_name, 1, name_len, srv->trace_file);
+    if (data->data2_len > 0) {
+        fwrite(data->data2, 1, data->data2_len, srv->trace_file);
+    }
+
+    // Flush periodically rather than per record, rpc_disable_trace flushes the rest
+    uint64_t now = monotonic_ns();
+    if (now - srv->trace_last_flush > (uint64_t)RPC_TRACE_FLUSH_INTERVAL_MS * 1000000ULL) {
+        fflush(srv->trace_file);
+        srv->trace_last_flush = now;
+    }
+    pthread_mutex_unlock(&srv->trace_lock);
+}
+
+/* Helper function to queue an accepted connection for the workers */
+int enqueue_connection(rpc_server *srv, struct connection_args *args) {
+    pthread_mutex_lock(&srv->conn_lock);
+    if (srv->queued >= srv->max_queued) {
+        pthread_mutex_unlock(&srv->conn_lock);
+        return -1;
+    }
+
+    // Add to the tail of the queue
+    args->queue_next = NULL;
+    if (srv->queue_tail != NULL) {
+        srv->queue_tail->queue_next = args;
+    } else {
+        srv->queue_head = args;
+    }
+    srv->queue_tail = args;
+    srv->queued++;
+
+    // Track the connection so a forced shutdown can close it
+    args->prev = NULL;
+    args->next = srv->connections;
+    if (srv->connections != NULL) {
+        srv->connections->prev = args;
+    }
+    srv->connections = args;
+    srv->in_flight++;
+
+    // Workers exit when the queue runs empty, so every busy worker is handling a request and
+    // another one is needed while below the limit
+    int needs_worker = srv->workers < srv->max_workers;
+    if (needs_worker) {
+        srv->workers++;
+    }
+    pthread_mutex_unlock(&srv->conn_lock);
+    return needs_worker;
+}
+
+/* Helper function to take the oldest queued connection, conn_lock must be held */
+static struct connection_args *dequeue_connection(rpc_server *srv) {
+    struct connection_args *args = srv->queue_head;
+    if (args != NULL) {
+        srv->queue_head = args->queue_next;
+        if (srv->queue_head == NULL) {
+            srv->queue_tail = NULL;
+        }
+        srv->queued--;
+    }
+    return args;
+}
+
+/* Helper function to start a worker that drains the connection queue */
+void start_worker(rpc_server *srv) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int pinned = set_worker_affinity(srv, &attr, 0);
+    pthread_t thread;
+    int created = pthread_create(&thread, &attr, connection_worker, srv);
+    pthread_attr_destroy(&attr);
+    if (created != 0 && pinned) {
+        // The CPUs may have become unavailable, run the worker where the server's caller ran
+        pthread_attr_init(&attr);
+        set_worker_affinity(srv, &attr, 1);
+        created = pthread_create(&thread, &attr, connection_worker, srv);
+        pthread_attr_destroy(&attr);
+    }
+    if (created == 0) {
+        pthread_detach(thread); // Detach the thread
+        return;
+    }
+
+    // pthread_create returns the error instead of setting errno
+    fprintf(stderr, "pthread_create: %s\n", strerror(created));
+
+    // Running workers pick up the queue, but if there are none nobody would, so answer the
+    // queued connections instead of leaving them waiting
+    pthread_mutex_lock(&srv->conn_lock);
+    srv->workers--;
+    struct connection_args *stranded = NULL;
+    if (srv->workers == 0) {
+        stranded = srv->queue_head;
+        srv->queue_head = NULL;
+        srv->queue_tail = NULL;
+        srv->queued = 0;
+    }
+    pthread_mutex_unlock(&srv->conn_lock);
+
+    while (stranded != NULL) {
+        struct connection_args *next = stranded->queue_next;
+        int sock = stranded->client_sock;
+        release_connection(srv, stranded);
+        reject_connection(sock);
+        free(stranded);
+        stranded = next;
+    }
+}
+
+/* Helper function run by worker threads, handles queued connections until the queue is empty */
+void *connection_worker(void *arg) {
+    rpc_server *srv = arg;
+    int node = -1;
+
+    pthread_mutex_lock(&srv->conn_lock);
+    struct connection_args *args;
+    while ((args = dequeue_connection(srv)) != NULL) {
+        pthread_mutex_unlock(&srv->conn_lock);
+        steer_worker(srv, args->client_sock, &node);
+        handle_connection(args);
+        pthread_mutex_lock(&srv->conn_lock);
+    }
+
+    // srv may be freed by rpc_shutdown once the worker is gone
+    srv->workers--;
+    pthread_cond_broadcast(&srv->conn_done);
+    pthread_mutex_unlock(&srv->conn_lock);
+    return NULL;
+}
+
+/* Helper function to answer a connection that can't be queued with RPC_OVERLOADED and close it */
+void reject_connection(int client_sock) {
+    // Discard the part of the request that already arrived, unread data makes close reset the
+    // connection, which can destroy the reply before the client reads it
+    char discard[4096];
+    while (recv(client_sock, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    rpc_send_message(client_sock, RPC_OVERLOADED, "", NULL);
+    shutdown(client_sock, SHUT_WR);
+    close(client_sock);
+}
+
+/* Helper function to remove a finished connection from the set closed by a forced shutdown */
+void release_connection(rpc_server *srv, struct connection_args *args) {
+    pthread_mutex_lock(&srv->conn_lock);
+    if (args->prev != NULL) {
+        args->prev->next = args->next;
+    } else {
+        srv->connections = args->next;
+    }
+    if (args->next != NULL) {
+        args->next->prev = args->prev;
+    }
+    srv->in_flight--;
+    pthread_cond_broadcast(&srv->conn_done);
+    pthread_mutex_unlock(&srv->conn_lock);
+}
+
+/* Helper function to handle a dequeued connection and fulfill request */
+void handle_connection(struct connection_args *args) {
     rpc_server *srv = args->srv;
     int client_sock = args->client_sock;
 
+    // Measure how long the connection queued since it was accepted
+    uint64_t sojourn_ns = monotonic_ns() - args->accepted_at;
+
     // Read the header: operation code, function name length, and data length from the client
-    int operation;
+    int operation = RPC_ERROR;
     size_t name_len, data_len;
     char *function_name;
     if (read_message(client_sock, &operation, &name_len, &data_len, &function_name) < 0) {
-        return NULL;
+        goto cleanup;
     }
 
     // Read the rpc data from the client
@@ -188,7 +686,7 @@ void *handle_connection(void *arg) {
     if (data == NULL) {
         perror("malloc");
         free(function_name);
-        return NULL;
+        goto cleanup;
     }
     data->data1 = 0;
     data->data2_len = data_len;
@@ -197,38 +695,40 @@ void *handle_connection(void *arg) {
         perror("malloc");
         free(function_name);
         free(data);
-        return NULL;
+        goto cleanup;
     }
 
     uint64_t data1_net;
     read(client_sock, &data1_net, sizeof(data1_net));
     data->data1 = ntohll(data1_net);
     read(client_sock, data->data2, data_len);
+    trace_request(srv, args->accepted_at, operation, function_name, data);
 
-    // Handle the operation
-    switch (operation) {
-        case RPC_FIND:
-            handle_rpc_find(client_sock, function_name, data, srv->registered_functions);
-            break;
-        case RPC_CALL:
-            handle_rpc_call(client_sock, function_name, data, srv->registered_functions);
-            break;
-        default:
-            free(function_name);
-            free(data->data2);
-            free(data);
-            close(client_sock);
-            free(arg);
-            return NULL;
+    // Handle the operation, answering immediately if the server is overloaded
+    if (admission_should_shed(srv, sojourn_ns)) {
+        rpc_send_message(client_sock, RPC_OVERLOADED, "", NULL);
+    } else {
+        switch (operation) {
+            case RPC_FIND:
+                handle_rpc_find(client_sock, function_name, data, load_registry(srv));
+                break;
+            case RPC_CALL:
+                handle_rpc_call(client_sock, function_name, data, srv);
+                break;
+            default:
+                break;
+        }
     }
 
-    // Clean up and close client
     free(function_name);
     free(data->data2);
     free(data);
+
+cleanup:
+    // Untrack before closing, so a forced shutdown never sees a reused descriptor
+    release_connection(srv, args);
     close(client_sock);
-    free(arg);
-    return NULL;
+    free(args);
 }
 
 /* Function to free rpc_data */
@@ -6,43 +6,173 @@
 #define COMP30023_2023_PROJECT_2_RPC_INTERNAL_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "rpc.h"
 
 #define NONBLOCKING
 #define RPC_ERROR 0
+#define RPC_OVERLOADED 4
 #define RPC_SUCCESS 1
 #define RPC_FIND 2
 #define RPC_CALL 3
 
+/* Local status recorded by the client when the server could not be reached */
+#define RPC_UNAVAILABLE (-1)
+
+/* Statuses a client call reports, see rpc_call_with_status() and rpc_last_status():
+ * RPC_SUCCESS     the call returned a result
+ * RPC_ERROR       the arguments were invalid, the function isn't registered or its handler failed
+ * RPC_OVERLOADED  the server shed the request without running it, retry later or elsewhere
+ * RPC_UNAVAILABLE the server could not be reached or closed the connection without answering */
+
+/* Admission control defaults, see rpc_set_admission_control() */
+#define RPC_MAX_WORKERS 128
+#define RPC_MAX_QUEUED 1024
+#define RPC_CODEL_TARGET_MS 5
+#define RPC_CODEL_INTERVAL_MS 100
+
+/* Highest number of NUMA nodes considered when steering connections */
+#define RPC_MAX_NUMA_NODES 64
+
+/* Request traces start with the magic and version, followed by one record per request:
+ * 8 byte arrival time in ns since the trace started, 4 byte operation, 4 byte name length,
+ * 4 byte data2 length, 8 byte data1, the function name and data2, all in network byte order */
+#define RPC_TRACE_MAGIC "RPCTRACE"
+#define RPC_TRACE_MAGIC_LEN 8
+#define RPC_TRACE_VERSION 1
+#define RPC_TRACE_RECORD_HEADER_LEN 28
+
+/* Traces are buffered and flushed at most once per interval */
+#define RPC_TRACE_BUFFER_LEN (1 << 20)
+#define RPC_TRACE_FLUSH_INTERVAL_MS 1000
+
+/* Byte order tags for typed arrays, elements are sent in the sender's byte order */
+#define RPC_LITTLE_ENDIAN 0
+#define RPC_BIG_ENDIAN 1
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RPC_HOST_BYTE_ORDER RPC_BIG_ENDIAN
+#else
+#define RPC_HOST_BYTE_ORDER RPC_LITTLE_ENDIAN
+#endif
+
+/* Typed arrays in data2 start with a header: type tag, byte order, 2 bytes padding and a
+ * 4 byte element count in network byte order */
+#define RPC_TYPED_HEADER_LEN 8
+
+/* Number of recent call latencies kept by the client to estimate p95 for hedging */
+#define RPC_LATENCY_SAMPLES 128
+#define RPC_MIN_HEDGE_SAMPLES 20
+
 
 struct connection_args {
     rpc_server *srv;
     int client_sock;
+    uint64_t accepted_at; // monotonic time accept returned the connection, its queueing starts here
+    struct connection_args *queue_next; // next connection waiting for a worker
+    struct connection_args *prev;
+    struct connection_args *next;
 };
 
 struct rpc_client {
     int is_connected;
     struct sockaddr_in6 server_addr;
+    pthread_mutex_t lock; // protects last_status, the latency samples and rand_seed
+    int last_status;      // status of the client's most recent call, see rpc_last_status()
+
+    // Secondary endpoint used for hedged requests and retries
+    struct sockaddr_in6 hedge_addr;
+    int has_hedge_addr;
+
+    // Ring buffer of recent call latencies in nanoseconds
+    uint64_t latency_samples[RPC_LATENCY_SAMPLES];
+    int latency_count;
+    int latency_next;
+    unsigned int rand_seed;
 };
 
+/* Element types of a typed array */
+typedef enum {
+    RPC_TYPE_I16 = 1,
+    RPC_TYPE_I32 = 2,
+    RPC_TYPE_I64 = 3,
+    RPC_TYPE_F32 = 4,
+    RPC_TYPE_F64 = 5
+} rpc_type;
+
+/* Options for calling idempotent functions, see rpc_call_with_options() */
+typedef struct {
+    int max_retries;        // extra attempts after a connection failure or RPC_OVERLOADED
+    int backoff_base_ms;    // backoff before the first retry, doubled for each retry
+    int backoff_max_ms;     // upper bound for the backoff
+    int hedge;              // send a duplicate request if no reply arrives within the p95 latency
+    int hedge_min_delay_ms; // lower bound for the hedge delay, also used until enough samples exist
+} rpc_call_options;
+
 struct rpc_handle {
     char *function_name;
 };
 
 struct rpc_server {
     int server_sock;
-    struct function_reg *registered_functions;
+    struct function_reg *registered_functions; // read without locking, see load_registry()
+    pthread_mutex_t registry_lock;             // serialises rpc_register
     int is_running;
+    int is_serving; // set while rpc_serve_all is running, protected by conn_lock
+
+    // Admission control: accepted connections wait in a bounded queue drained by a bounded
+    // number of workers, and CoDel-style shedding on the time spent in that queue
+    pthread_mutex_t conn_lock;
+    pthread_cond_t conn_done;
+    struct connection_args *connections; // connections queued or being handled
+    int in_flight;                       // length of connections
+    struct connection_args *queue_head;
+    struct connection_args *queue_tail;
+    int queued;
+    int max_queued;
+    int workers;
+    int max_workers;
+    uint64_t codel_target_ns;
+    uint64_t codel_interval_ns;
+    uint64_t codel_interval_start;
+    uint64_t codel_min_delay;
+    int codel_overloaded;
+
+    // In-progress calls of single-flight functions
+    pthread_mutex_t flight_lock;
+    struct flight *flights;
+
+    // Binary trace of incoming requests, NULL when tracing is off
+    pthread_mutex_t trace_lock;
+    FILE *trace_file;
+    uint64_t trace_start;
+    uint64_t trace_last_flush;
+
+    // Thread placement, NULL when threads may float, see rpc_affinity.c
+    struct cpu_affinity *affinity;
 };
 
 /* Using a linked list to store all the registered function for the server */
 typedef struct function_reg {
     char *function_name;
     rpc_data* (*handler)(rpc_data*);
+    int single_flight; // coalesce concurrent identical calls into one handler run
     struct function_reg *next;
 } function_reg;
 
+/* An in-progress call of a single-flight function that identical requests wait on */
+typedef struct flight {
+    function_reg *func;
+    rpc_handler handler; // calls after a handler swap don't join flights of the old handler
+    rpc_data *request;   // owned by the connection that runs the handler
+    rpc_data *result;
+    int done;
+    int waiters; // connections still holding a reference, the last one frees the flight
+    pthread_cond_t finished;
+    struct flight *next;
+} flight;
+
 
 /* Helper function to convert 8-byte integer to network byte order */
 uint64_t htonll(uint64_t value);
@@ -50,29 +180,180 @@ uint64_t htonll(uint64_t value);
 /* Helper function to convert network byte order to 8-byte integer */
 uint64_t ntohll(uint64_t value);
 
+/* Helper function to read the monotonic clock in nanoseconds */
+uint64_t monotonic_ns(void);
+
 /* Helper function to send message using designed protocol */
 int rpc_send_message(int sock, int operation, char *name, rpc_data *data);
 
 /* Helper function to receive message using designed protocol */
 int read_message(int client_sock, int *operation, size_t *name_len, size_t *data_len, char **function_name);
 
+/* Helper function to create client socket and connect to the given address */
+int connect_to_address(const struct sockaddr_in6 *addr);
+
 /* Helper function to create client socket and connect with server */
 int create_and_connect_socket(rpc_client *cl);
 
+/* Helper function to record the status of the last response, safe for shared clients */
+void set_last_status(rpc_client *cl, int status);
+
+/* Helper function to receive a call response and close the socket */
+/* RETURNS: rpc_data* on success, NULL on error with the status in *status */
+rpc_data *receive_call_response(rpc_client *cl, int client_sock, int *status);
+
+/* Helper function to send a call to addr and wait for the response */
+rpc_data *send_and_receive_call(rpc_client *cl, const struct sockaddr_in6 *addr, rpc_handle *h,
+                                rpc_data *payload, int *status);
+
+/* Helper function to send a call to primary, hedged to secondary once the p95 delay has passed */
+rpc_data *hedged_call(rpc_client *cl, const struct sockaddr_in6 *primary,
+                      const struct sockaddr_in6 *secondary, rpc_handle *h, rpc_data *payload,
+                      const rpc_call_options *opts, int *status);
+
+/* Helper function to record the latency of a successful call */
+void record_call_latency(rpc_client *cl, uint64_t latency_ns);
+
+/* Helper function to compute the hedge delay from the recorded p95 latency */
+int hedge_delay_ms(rpc_client *cl, const rpc_call_options *opts);
+
+/* Sets a secondary endpoint used by hedged requests and retries */
+/* RETURNS: -1 on failure */
+int rpc_add_hedge_endpoint(rpc_client *cl, char *addr, int port);
+
+/* Same as rpc_call, and stores the call's status in *status unless status is NULL */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call_with_status(rpc_client *cl, rpc_handle *h, rpc_data *payload, int *status);
+
+/* Calls an idempotent remote function, retrying with jittered exponential backoff on
+ * connection failure or overload, and optionally hedging slow requests. The status of the
+ * last attempt is stored in *status unless status is NULL. */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call_with_options(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                                const rpc_call_options *opts, int *status);
+
+/* Gets the status of the most recent rpc_find or call made with cl. If other threads share
+ * cl it may belong to their call, use the status out-parameter of rpc_call_with_status or
+ * rpc_call_with_options instead. */
+/* RETURNS: one of the statuses listed with RPC_UNAVAILABLE */
+int rpc_last_status(rpc_client *cl);
+
+/* Helper function to get the registered functions, safe while rpc_register runs */
+function_reg *load_registry(rpc_server *srv);
+
 /* Helper function to find the requested function */
 function_reg *find_function(char *function_name, function_reg *function_list);
 
 /* Helper function to handle find request */
 void handle_rpc_find(int client_sock, char *function_name, const rpc_data *data, function_reg *function_list);
 
+/* Helper function to copy a rpc_data struct */
+rpc_data *copy_rpc_data(const rpc_data *data);
+
+/* Helper function to run a single-flight handler, sharing the result with identical concurrent calls */
+/* RETURNS: rpc_data* owned by the caller, NULL if the handler failed */
+rpc_data *single_flight_call(rpc_server *srv, function_reg *func, rpc_handler handler, rpc_data *data);
+
 /* Helper function to handle call request */
-void handle_rpc_call(int client_sock, char *function_name, rpc_data *data, function_reg *function_list);
+void handle_rpc_call(int client_sock, char *function_name, rpc_data *data, rpc_server *srv);
+
+/* Enables or disables single-flight mode for a registered function, only use it for
+ * pure handlers whose result depends on nothing but data1 and data2 */
+/* RETURNS: -1 on failure */
+int rpc_set_single_flight(rpc_server *srv, char *name, int enabled);
+
+/* Starts recording incoming requests to a binary trace at path, see rpc-replay */
+/* RETURNS: -1 on failure */
+int rpc_enable_trace(rpc_server *srv, char *path);
+
+/* Stops recording requests and closes the trace */
+void rpc_disable_trace(rpc_server *srv);
+
+/* Helper function to append a request that arrived at arrival_ns to the trace */
+void trace_request(rpc_server *srv, uint64_t arrival_ns, int operation, char *function_name,
+                   const rpc_data *data);
+
+/* Helper function to decide whether a request that waited sojourn_ns should be shed */
+int admission_should_shed(rpc_server *srv, uint64_t sojourn_ns);
+
+/* Helper function to queue an accepted connection for the workers */
+/* RETURNS: 1 if a new worker must be started, 0 if a running one will take it, -1 if the
+ * queue is full */
+int enqueue_connection(rpc_server *srv, struct connection_args *args);
+
+/* Helper function to start a worker that drains the connection queue */
+void start_worker(rpc_server *srv);
+
+/* Helper function to answer a connection that can't be queued with RPC_OVERLOADED and close it */
+void reject_connection(int client_sock);
 
-/* Helper function to handle a new connection and fulfill request */
-void *handle_connection(void *arg);
+/* Helper function to remove a finished connection from the set closed by a forced shutdown */
+void release_connection(rpc_server *srv, struct connection_args *args);
+
+/* Stops accepting connections and closes the listening socket, waits up to
+ * drain_timeout_ms for in-flight requests and then closes the remaining connections and
+ * waits for their handlers to return. rpc_serve_all returns, or returns at once if it
+ * hasn't started yet. Safe to call from any thread and more than once, but not from a
+ * handler. The server stays allocated, see rpc_free_server(). */
+/* RETURNS: -1 if connections had to be closed before their requests finished */
+int rpc_shutdown(rpc_server *srv, int drain_timeout_ms);
+
+/* Shuts the server down if that hasn't happened yet and frees it. Call once rpc_serve_all
+ * has returned, or if it is never called, and after every other use of srv has finished. */
+void rpc_free_server(rpc_server *srv);
+
+/* Configures admission control: at most max_workers concurrent requests and max_queued
+ * accepted connections waiting for a worker. Connections beyond the queue, and queued
+ * requests once their queueing delay stays above target_ms for interval_ms, are answered
+ * with RPC_OVERLOADED */
+/* RETURNS: -1 on failure */
+int rpc_set_admission_control(rpc_server *srv, int max_workers, int max_queued, int target_ms,
+                              int interval_ms);
+
+/* Helper function run by worker threads, handles queued connections until the queue is empty */
+void *connection_worker(void *arg);
+
+/* Helper function to handle a dequeued connection and fulfill request */
+void handle_connection(struct connection_args *args);
 
 /* Function to free rpc_data */
 void rpc_data_free(rpc_data *data);
 
+/* Helper function to get the size of one element of a typed array */
+/* RETURNS: element size in bytes, 0 for an unknown type */
+size_t rpc_type_size(rpc_type type);
+
+/* Helper function to byte swap an array of 2, 4 or 8 byte elements, dst may equal src */
+void bswap_array(void *dst, const void *src, size_t elem_size, size_t count);
+
+/* Encodes count elements of the given type into data->data2, replacing any previous data2 */
+/* RETURNS: -1 on failure */
+int rpc_data_set_array(rpc_data *data, rpc_type type, const void *elements, size_t count);
+
+/* Decodes the typed array in data->data2, converting it to host byte order in place */
+/* RETURNS: pointer to the elements inside data2 on success, NULL on error */
+void *rpc_data_get_array(rpc_data *data, rpc_type *type, size_t *count);
+
+/* Pins the accept thread to io_cpus while rpc_serve_all runs and worker threads to
+ * worker_cpus (any CPU if n_workers is 0). Each worker further moves to the NUMA node of the
+ * CPU that received the connection it handles (SO_INCOMING_CPU). Call before rpc_serve_all. */
+/* RETURNS: -1 on failure */
+int rpc_set_cpu_affinity(rpc_server *srv, const int *io_cpus, int n_io, const int *worker_cpus,
+                         int n_workers);
+
+/* Helper function to pin the calling accept thread to the I/O CPUs, saving its CPUs first */
+void pin_io_thread(rpc_server *srv);
+
+/* Helper function to move the accept thread back to the CPUs it had before pin_io_thread */
+void restore_io_thread(rpc_server *srv);
+
+/* Helper function to place a new worker thread on the worker CPUs, or on the CPUs the
+ * accept thread had before pin_io_thread if fallback is set */
+/* RETURNS: 1 if an affinity was set on attr, 0 otherwise */
+int set_worker_affinity(rpc_server *srv, pthread_attr_t *attr, int fallback);
+
+/* Helper function to move a worker to the NUMA node that receives a connection's packets,
+ * *node is the worker's current node or -1 */
+void steer_worker(rpc_server *srv, int client_sock, int *node);
 
 #endif //COMP30023_2023_PROJECT_2_RPC_INTERNAL_H
@@ -8,6 +8,7 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 
 /* Function to initialize server */
@@ -49,10 +50,105 @@ rpc_server *rpc_init_server(int port) {
     }
 
     server->registered_functions = NULL;
+    pthread_mutex_init(&server->registry_lock, NULL);
     server->is_running = 1;
+    server->is_serving = 0;
+
+    // Set up admission control with the default limits, conn_done uses the monotonic clock
+    // so rpc_shutdown's drain deadline isn't affected by wall clock changes
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server->conn_lock, NULL);
+    pthread_cond_init(&server->conn_done, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    server->connections = NULL;
+    server->in_flight = 0;
+    server->queue_head = NULL;
+    server->queue_tail = NULL;
+    server->queued = 0;
+    server->workers = 0;
+    server->codel_interval_start = monotonic_ns();
+    server->codel_min_delay = 0;
+    server->codel_overloaded = 0;
+    rpc_set_admission_control(server, RPC_MAX_WORKERS, RPC_MAX_QUEUED, RPC_CODEL_TARGET_MS,
+                              RPC_CODEL_INTERVAL_MS);
+
+    pthread_mutex_init(&server->flight_lock, NULL);
+    server->flights = NULL;
+
+    pthread_mutex_init(&server->trace_lock, NULL);
+    server->trace_file = NULL;
+    server->trace_start = 0;
+
+    server->affinity = NULL;
     return server;
 }
 
+/* Function to start recording incoming requests to a binary trace */
+int rpc_enable_trace(rpc_server *srv, char *path) {
+    // Return failure if any of the arguments is NULL
+    if (srv == NULL || path == NULL) {
+        return -1;
+    }
+
+    FILE *trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    // Buffer records so tracing doesn't add a write per request
+    setvbuf(trace_file, NULL, _IOFBF, RPC_TRACE_BUFFER_LEN);
+
+    // Write the trace header
+    uint32_t version_net = htonl(RPC_TRACE_VERSION);
+    fwrite(RPC_TRACE_MAGIC, 1, RPC_TRACE_MAGIC_LEN, trace_file);
+    fwrite(&version_net, 1, sizeof(version_net), trace_file);
+
+    // Replace any trace that is already being recorded
+    pthread_mutex_lock(&srv->trace_lock);
+    if (srv->trace_file != NULL) {
+        fclose(srv->trace_file);
+    }
+    srv->trace_file = trace_file;
+    srv->trace_start = monotonic_ns();
+    srv->trace_last_flush = srv->trace_start;
+    pthread_mutex_unlock(&srv->trace_lock);
+    return 1;
+}
+
+/* Function to stop recording requests */
+void rpc_disable_trace(rpc_server *srv) {
+    if (srv == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&srv->trace_lock);
+    if (srv->trace_file != NULL) {
+        fclose(srv->trace_file);
+        srv->trace_file = NULL;
+    }
+    pthread_mutex_unlock(&srv->trace_lock);
+}
+
+/* Function to configure admission control */
+int rpc_set_admission_control(rpc_server *srv, int max_workers, int max_queued, int target_ms,
+                              int interval_ms) {
+    // Return failure if any of the limits is not positive or the target exceeds the interval
+    if (srv == NULL || max_workers < 1 || max_queued < 1 || target_ms < 1 || interval_ms < target_ms) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&srv->conn_lock);
+    srv->max_workers = max_workers;
+    srv->max_queued = max_queued;
+    srv->codel_target_ns = (uint64_t)target_ms * 1000000ULL;
+    srv->codel_interval_ns = (uint64_t)interval_ms * 1000000ULL;
+    pthread_mutex_unlock(&srv->conn_lock);
+    return 1;
+}
+
 /* Function to register the server functions */
 int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
     // Return failure if any of the arguments is NULL or name is empty
@@ -60,11 +156,17 @@ int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
         return -1;
     }
 
+    // Registrations may happen while serving, so writers are serialised and every change is
+    // published atomically for the lock-free readers in the connection threads
+    pthread_mutex_lock(&srv->registry_lock);
+
     // Check if a function with the same name is already registered
     function_reg *existing_function = find_function(name, srv->registered_functions);
     if (existing_function != NULL) {
-        // If a function with the same name is already registered, overwrite its handler
-        existing_function->handler = handler;
+        // If a function with the same name is already registered, swap in the new handler.
+        // Calls already running finish with the old handler.
+        __atomic_store_n(&existing_function->handler, handler, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&srv->registry_lock);
         return 1;
     }
 
@@ -72,6 +174,7 @@ int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
     function_reg *new_function = malloc((sizeof(function_reg)));
     if (new_function == NULL) {
         perror("malloc");
+        pthread_mutex_unlock(&srv->registry_lock);
         return -1;
     }
 
@@ -80,11 +183,30 @@ int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
     if (new_function->function_name == NULL) {
         perror("strdup");
         free(new_function);
+        pthread_mutex_unlock(&srv->registry_lock);
         return -1;
     }
     new_function->handler = handler;
+    new_function->single_flight = 0;
     new_function->next = srv->registered_functions;
-    srv->registered_functions = new_function;
+    __atomic_store_n(&srv->registered_functions, new_function, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&srv->registry_lock);
+    return 1;
+}
+
+/* Function to enable or disable single-flight mode for a registered function */
+int rpc_set_single_flight(rpc_server *srv, char *name, int enabled) {
+    // Return failure if any of the arguments is NULL
+    if (srv == NULL || name == NULL) {
+        return -1;
+    }
+
+    // Return failure if the function isn't registered
+    function_reg *func = find_function(name, load_registry(srv));
+    if (func == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&func->single_flight, enabled != 0, __ATOMIC_RELAXED);
     return 1;
 }
 
@@ -95,27 +217,137 @@ void rpc_serve_all(rpc_server *srv) {
         return;
     }
 
+    // Return at once if rpc_shutdown already ran, its listening socket is closed
+    pthread_mutex_lock(&srv->conn_lock);
+    if (!srv->is_running) {
+        pthread_mutex_unlock(&srv->conn_lock);
+        return;
+    }
+    srv->is_serving = 1;
+    pthread_mutex_unlock(&srv->conn_lock);
+
+    pin_io_thread(srv);
+
     // Listen for incoming connections
-    listen(srv->server_sock, 5);
+    listen(srv->server_sock, SOMAXCONN);
 
-    // Accept incoming connections in an infinite loop
-    while (srv->is_running) {
+    // Accept incoming connections until rpc_shutdown is called. Connections are accepted
+    // eagerly so they queue here, where the time they wait is visible, rather than in the
+    // kernel backlog.
+    while (__atomic_load_n(&srv->is_running, __ATOMIC_ACQUIRE)) {
         int client_sock = accept(srv->server_sock, NULL, NULL);
         if (client_sock < 0) {
             continue;
         }
 
-        // Handle the connection in a new thread
         struct connection_args *args = malloc(sizeof(struct connection_args));
         if (args == NULL) {
             perror("malloc");
-            close(client_sock);
+            reject_connection(client_sock);
             continue;
         }
         args->srv = srv;
         args->client_sock = client_sock;
-        pthread_t thread;
-        pthread_create(&thread, NULL, handle_connection, args);
-        pthread_detach(thread); // Detach the thread
+        args->accepted_at = monotonic_ns();
+
+        // Queue the connection for a worker, answering at once if the queue is full
+        int needs_worker = enqueue_connection(srv, args);
+        if (needs_worker < 0) {
+            reject_connection(client_sock);
+            free(args);
+        } else if (needs_worker) {
+            start_worker(srv);
+        }
+    }
+
+    restore_io_thread(srv);
+
+    // Let rpc_shutdown know the accept loop no longer uses the server
+    pthread_mutex_lock(&srv->conn_lock);
+    srv->is_serving = 0;
+    pthread_cond_broadcast(&srv->conn_done);
+    pthread_mutex_unlock(&srv->conn_lock);
+}
+
+/* Function to stop the server and drain in-flight requests */
+int rpc_shutdown(rpc_server *srv, int drain_timeout_ms) {
+    // Return failure if srv is NULL
+    if (srv == NULL) {
+        return -1;
+    }
+
+    // Stop accepting, shutting down the listening socket wakes a blocked accept
+    pthread_mutex_lock(&srv->conn_lock);
+    __atomic_store_n(&srv->is_running, 0, __ATOMIC_RELEASE);
+    if (srv->server_sock >= 0) {
+        shutdown(srv->server_sock, SHUT_RDWR);
     }
+    pthread_cond_broadcast(&srv->conn_done);
+
+    // Wait for the accept loop to exit, then release the port
+    while (srv->is_serving) {
+        pthread_cond_wait(&srv->conn_done, &srv->conn_lock);
+    }
+    if (srv->server_sock >= 0) {
+        close(srv->server_sock);
+        srv->server_sock = -1;
+    }
+
+    // Drain in-flight requests until the deadline
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += drain_timeout_ms / 1000;
+    deadline.tv_nsec += (long)(drain_timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int result = 1;
+    while (srv->in_flight > 0) {
+        if (pthread_cond_timedwait(&srv->conn_done, &srv->conn_lock, &deadline) != 0 &&
+            srv->in_flight > 0) {
+            // Deadline passed, cut the remaining connections so their reads and writes fail
+            for (struct connection_args *conn = srv->connections; conn != NULL; conn = conn->next) {
+                shutdown(conn->client_sock, SHUT_RDWR);
+            }
+            result = -1;
+            break;
+        }
+    }
+
+    // Handlers can't be interrupted, wait for them and their workers to return
+    while (srv->in_flight > 0 || srv->workers > 0) {
+        pthread_cond_wait(&srv->conn_done, &srv->conn_lock);
+    }
+    pthread_mutex_unlock(&srv->conn_lock);
+    return result;
+}
+
+/* Function to free the server */
+void rpc_free_server(rpc_server *srv) {
+    if (srv == NULL) {
+        return;
+    }
+
+    // Make sure nothing is accepting or handling connections any more
+    rpc_shutdown(srv, 0);
+
+    // Free the registry
+    function_reg *func = srv->registered_functions;
+    while (func != NULL) {
+        function_reg *next = func->next;
+        free(func->function_name);
+        free(func);
+        func = next;
+    }
+
+    // Free the rest of the server state
+    rpc_disable_trace(srv);
+    free(srv->affinity);
+    pthread_mutex_destroy(&srv->registry_lock);
+    pthread_mutex_destroy(&srv->conn_lock);
+    pthread_cond_destroy(&srv->conn_done);
+    pthread_mutex_destroy(&srv->flight_lock);
+    pthread_mutex_destroy(&srv->trace_lock);
+    free(srv);
 }
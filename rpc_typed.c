@@ -0,0 +1,180 @@
+#include "rpc.h"
+#include "rpc_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RPC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+/* Helper function to get the size of one element of a typed array */
+size_t rpc_type_size(rpc_type type) {
+    switch (type) {
+        case RPC_TYPE_I16:
+            return 2;
+        case RPC_TYPE_I32:
+        case RPC_TYPE_F32:
+            return 4;
+        case RPC_TYPE_I64:
+        case RPC_TYPE_F64:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+#ifdef RPC_X86_SIMD
+/* Shuffle masks reversing the bytes of each 2, 4 or 8 byte element in a 16 byte lane */
+static const uint8_t swap_masks[3][16] = {
+    {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+    {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+    {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8},
+};
+
+/* Helper function to pick the shuffle mask for an element size */
+static const uint8_t *swap_mask(size_t elem_size) {
+    return swap_masks[elem_size == 2 ? 0 : elem_size == 4 ? 1 : 2];
+}
+
+/* Helper function to byte swap 32 bytes at a time, returns the number of bytes swapped */
+__attribute__((target("avx2"))) static size_t bswap_avx2(uint8_t *dst, const uint8_t *src,
+                                                         size_t len, size_t elem_size) {
+    // AVX2 shuffles within each 128-bit lane, so the same mask is used for both halves
+    const __m128i lane = _mm_loadu_si128((const __m128i *)swap_mask(elem_size));
+    const __m256i mask = _mm256_broadcastsi128_si256(lane);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+/* Helper function to byte swap 16 bytes at a time, returns the number of bytes swapped */
+__attribute__((target("ssse3"))) static size_t bswap_ssse3(uint8_t *dst, const uint8_t *src,
+                                                           size_t len, size_t elem_size) {
+    const __m128i mask = _mm_loadu_si128((const __m128i *)swap_mask(elem_size));
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+#endif
+
+/* Helper function to byte swap an array of 2, 4 or 8 byte elements, dst may equal src */
+void bswap_array(void *dst, const void *src, size_t elem_size, size_t count) {
+    uint8_t *out = dst;
+    const uint8_t *in = src;
+    size_t len = elem_size * count;
+    size_t done = 0;
+
+#ifdef RPC_X86_SIMD
+    // Use the widest shuffle the CPU supports for the bulk of the array
+    if (__builtin_cpu_supports("avx2")) {
+        done = bswap_avx2(out, in, len, elem_size);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        done = bswap_ssse3(out, in, len, elem_size);
+    }
+#endif
+
+    // Scalar fallback for the remaining elements
+    for (; done < len; done += elem_size) {
+        if (elem_size == 2) {
+            uint16_t v;
+            memcpy(&v, in + done, 2);
+            v = __builtin_bswap16(v);
+            memcpy(out + done, &v, 2);
+        } else if (elem_size == 4) {
+            uint32_t v;
+            memcpy(&v, in + done, 4);
+            v = __builtin_bswap32(v);
+            memcpy(out + done, &v, 4);
+        } else {
+            uint64_t v;
+            memcpy(&v, in + done, 8);
+            v = __builtin_bswap64(v);
+            memcpy(out + done, &v, 8);
+        }
+    }
+}
+
+/* Function to encode a typed array into data2 */
+int rpc_data_set_array(rpc_data *data, rpc_type type, const void *elements, size_t count) {
+    // Return failure if any of the arguments is invalid
+    size_t elem_size = rpc_type_size(type);
+    if (data == NULL || elem_size == 0 || (elements == NULL && count > 0)) {
+        return -1;
+    }
+
+    // Check if the array is too large to be encoded in the packet format
+    size_t len = RPC_TYPED_HEADER_LEN + elem_size * count;
+    if (count > UINT32_MAX || len > 100000) {
+        fprintf(stderr, "Overlength error\n");
+        return -1;
+    }
+
+    uint8_t *buf = malloc(len);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    // Header: type tag, byte order of the elements, padding and the element count
+    uint32_t count_net = htonl((uint32_t)count);
+    buf[0] = (uint8_t)type;
+    buf[1] = RPC_HOST_BYTE_ORDER;
+    buf[2] = 0;
+    buf[3] = 0;
+    memcpy(buf + 4, &count_net, sizeof(count_net));
+
+    // Elements are sent in host byte order, the receiver only swaps if its order differs
+    if (count > 0) {
+        memcpy(buf + RPC_TYPED_HEADER_LEN, elements, elem_size * count);
+    }
+
+    free(data->data2);
+    data->data2 = buf;
+    data->data2_len = len;
+    return 1;
+}
+
+/* Function to decode a typed array from data2 */
+void *rpc_data_get_array(rpc_data *data, rpc_type *type, size_t *count) {
+    // Return NULL if any of the arguments is NULL or data2 is too short for the header
+    if (data == NULL || data->data2 == NULL || data->data2_len < RPC_TYPED_HEADER_LEN) {
+        return NULL;
+    }
+
+    uint8_t *buf = data->data2;
+    size_t elem_size = rpc_type_size((rpc_type)buf[0]);
+    uint32_t count_net;
+    memcpy(&count_net, buf + 4, sizeof(count_net));
+    size_t n = ntohl(count_net);
+
+    // Return NULL if the header doesn't match the payload
+    if (elem_size == 0 || buf[1] > RPC_BIG_ENDIAN ||
+        data->data2_len != RPC_TYPED_HEADER_LEN + elem_size * n) {
+        return NULL;
+    }
+
+    // Convert in place only if the sender's byte order differs from ours
+    if (buf[1] != RPC_HOST_BYTE_ORDER) {
+        bswap_array(buf + RPC_TYPED_HEADER_LEN, buf + RPC_TYPED_HEADER_LEN, elem_size, n);
+        buf[1] = RPC_HOST_BYTE_ORDER;
+    }
+
+    if (type != NULL) {
+        *type = (rpc_type)buf[0];
+    }
+    if (count != NULL) {
+        *count = n;
+    }
+    return buf + RPC_TYPED_HEADER_LEN;
+}
@@ -1,24 +1,46 @@
 #include "rpc.h"
+#include "rpc_internal.h"
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 rpc_data *add2_i8(rpc_data *);
 
+/* Waits for SIGINT or SIGTERM and shuts the server down, draining for up to 5 seconds */
+void *shutdown_on_signal(void *arg) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    int sig;
+    sigwait(&signals, &sig);
+    fprintf(stderr, "Shutting down\n");
+    if (rpc_shutdown(arg, 5000) == -1) {
+        fprintf(stderr, "Closed connections that didn't drain in time\n");
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
     rpc_server *state;
     int port = 3000; // default port
+    char *trace_path = NULL;
     int opt;
 
     // Parse command line options
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:t:")) != -1) {
         switch (opt) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 't':
+                trace_path = optarg;
+                break;
             default: /* '?' */
-                fprintf(stderr, "Usage: %s [-p port]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-p port] [-t trace]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -29,13 +51,35 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (trace_path != NULL && rpc_enable_trace(state, trace_path) == -1) {
+        fprintf(stderr, "Failed to open trace %s\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+
     if (rpc_register(state, "add2", add2_i8) == -1) {
         fprintf(stderr, "Failed to register add2\n");
         exit(EXIT_FAILURE);
     }
+    // Handle shutdown signals on a dedicated thread, every other thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t shutdown_thread;
+    if (pthread_create(&shutdown_thread, NULL, shutdown_on_signal, state) != 0) {
+        fprintf(stderr, "Failed to start shutdown thread\n");
+        exit(EXIT_FAILURE);
+    }
+
     fprintf(stderr, "Serving\n");
     rpc_serve_all(state);
-    fprintf(stderr, "failed Serving\n");
+
+    // rpc_serve_all returns once the shutdown thread has stopped the server, or at once if
+    // the signal arrived before it started. Free the server when neither uses it any more.
+    pthread_join(shutdown_thread, NULL);
+    rpc_free_server(state);
+    fprintf(stderr, "Stopped serving\n");
     return 0;
 }
 